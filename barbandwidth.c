@@ -2,10 +2,13 @@
 // Util
 //
 #include <stdint.h>
+#include <math.h>
 #include <intrin.h>
 
 typedef uint8_t     u8;
 typedef int8_t      s8;
+typedef uint16_t    u16;
+typedef int16_t     s16;
 typedef uint32_t    u32;
 typedef int32_t     s32;
 typedef uint64_t    u64;
@@ -28,6 +31,168 @@ typedef u32 b32;
 inline u64 Min(u64 A, u64 B) { return A < B ? A : B; }
 inline u64 Max(u64 A, u64 B) { return A < B ? B : A; }
 
+inline u64 XorShift64(u64* State)
+{
+    u64 X = *State;
+    X ^= X << 13;
+    X ^= X >> 7;
+    X ^= X << 17;
+    *State = X;
+    return(X);
+}
+
+//
+// Simulated BAR
+//
+// Stand-in for a real BAR mapping on machines without a discrete GPU: the
+// kernels write to plain host memory. Before the reps of a test, the harness
+// replays the written ranges once through a model of the write-combining
+// buffers and the PCIe link to get the time at which the modeled hardware
+// would have accepted the last write, and every rep then spins until that
+// much time has passed since it started. Each replay starts with an idle
+// link and empty buffers, so nothing carries over between reps or tests.
+//
+// A line holds one WC buffer from the moment it's issued until it has been
+// sent over the link and the posted write latency has elapsed, so sustained
+// throughput is bounded by both the link rate and
+// BufferCount * LineSize / PostedWriteLatency.
+// Full lines go out as a single transaction, partially written lines are
+// split into PartialChunkSize sized transactions that each pay the overhead.
+//
+#define SimBARLineSize          64
+#define SimBARMaxBufferCount    64
+
+typedef struct sim_bar_config
+{
+    f64 LinkBandwidth;          // Bytes/s
+    f64 PostedWriteLatency;     // Seconds
+    u32 BufferCount;
+    u32 TransactionOverhead;    // Header bytes per transaction
+    u32 PartialChunkSize;
+} sim_bar_config;
+
+typedef struct sim_bar
+{
+    sim_bar_config Config;
+    f64 CyclesPerByte;
+    f64 LatencyCycles;
+
+    f64 Now;                    // Issue time of the last transaction
+    f64 LinkFreeAt;
+    f64 BufferFreeAt[SimBARMaxBufferCount];
+    u32 NextBuffer;
+
+    umm OpenLine;               // Line currently being combined
+    umm OpenBytes;
+} sim_bar;
+
+static void SimBARInitialize(sim_bar* BAR, sim_bar_config Config, u64 TSCFrequency)
+{
+    Assert((Config.BufferCount > 0 && Config.BufferCount <= SimBARMaxBufferCount));
+
+    sim_bar Result = {0};
+    Result.Config = Config;
+    Result.CyclesPerByte = (f64)TSCFrequency / Config.LinkBandwidth;
+    Result.LatencyCycles = (f64)TSCFrequency * Config.PostedWriteLatency;
+    *BAR = Result;
+}
+
+static void SimBARIssue(sim_bar* BAR, umm ByteCount)
+{
+    u32 TransactionCount = 1;
+    if (ByteCount < SimBARLineSize)
+    {
+        TransactionCount = (u32)((ByteCount + BAR->Config.PartialChunkSize - 1) / BAR->Config.PartialChunkSize);
+    }
+
+    f64* BufferFreeAt = BAR->BufferFreeAt + BAR->NextBuffer;
+    f64 Issue = BAR->Now > *BufferFreeAt ? BAR->Now : *BufferFreeAt;
+    f64 Start = Issue > BAR->LinkFreeAt ? Issue : BAR->LinkFreeAt;
+
+    BAR->LinkFreeAt = Start + (f64)(ByteCount + TransactionCount*BAR->Config.TransactionOverhead) * BAR->CyclesPerByte;
+    *BufferFreeAt = BAR->LinkFreeAt + BAR->LatencyCycles;
+    BAR->NextBuffer = (BAR->NextBuffer + 1) % BAR->Config.BufferCount;
+    BAR->Now = Issue;
+}
+
+static void SimBARBegin(sim_bar* BAR)
+{
+    BAR->Now = 0.0;
+    BAR->LinkFreeAt = 0.0;
+    for (u32 BufferIndex = 0; BufferIndex < SimBARMaxBufferCount; BufferIndex++)
+    {
+        BAR->BufferFreeAt[BufferIndex] = 0.0;
+    }
+    BAR->NextBuffer = 0;
+    BAR->OpenLine = ~(umm)0;
+    BAR->OpenBytes = 0;
+}
+
+static void SimBARWrite(sim_bar* BAR, umm Offset, umm Size)
+{
+    while (Size)
+    {
+        umm Line = Offset / SimBARLineSize;
+        umm Chunk = Min(Size, SimBARLineSize - (Offset % SimBARLineSize));
+
+        if (Line != BAR->OpenLine)
+        {
+            if (BAR->OpenBytes)
+            {
+                SimBARIssue(BAR, BAR->OpenBytes);
+            }
+            BAR->OpenLine = Line;
+            BAR->OpenBytes = 0;
+        }
+
+        BAR->OpenBytes = Min(BAR->OpenBytes + Chunk, SimBARLineSize);
+        if (BAR->OpenBytes == SimBARLineSize)
+        {
+            SimBARIssue(BAR, BAR->OpenBytes);
+            BAR->OpenLine = ~(umm)0;
+            BAR->OpenBytes = 0;
+        }
+
+        Offset += Chunk;
+        Size -= Chunk;
+    }
+}
+
+// Returns the modeled duration in TSC cycles since SimBARBegin
+static u64 SimBAREnd(sim_bar* BAR)
+{
+    if (BAR->OpenBytes)
+    {
+        SimBARIssue(BAR, BAR->OpenBytes);
+        BAR->OpenLine = ~(umm)0;
+        BAR->OpenBytes = 0;
+    }
+
+    u64 Result = (u64)ceil(BAR->Now);
+    return(Result);
+}
+
+//
+// Energy counters
+//
+// Cumulative RAPL package/DRAM energy in joules, provided by the platform layer.
+// The hardware updates the counters roughly every millisecond, so only tests
+// that run for at least several milliseconds in total give usable numbers.
+//
+typedef struct energy_counters
+{
+    b32 IsPresent;
+    b32 HasDRAM;
+} energy_counters;
+
+typedef struct energy_sample
+{
+    f64 Package;    // Joules
+    f64 DRAM;
+} energy_sample;
+
+static energy_sample SampleEnergy(void);
+
 //
 // Testing harness
 //
@@ -43,16 +208,96 @@ typedef enum test_type
 {
     TestType_Write = 0,
     TestType_Copy,
+    TestType_SparseWrite,   // Patch scattered fields directly in the BAR
+    TestType_SparseCopy,    // Copy scattered fields from the same offsets in host memory directly to the BAR
+    TestType_SparseRebuild, // Patch a host copy, then stream the whole region to the BAR
+    TestType_Gather,        // Copy a list of scattered host fragments back-to-back into the BAR
 } test_type;
 
+typedef enum sparse_pattern
+{
+    SparsePattern_Strided = 0,
+    SparsePattern_Random,
+} sparse_pattern;
+
+// Sparse kernels take one of these as Src and the patch count as Count
+typedef struct sparse_patches
+{
+    u8*     Source;     // Patches are read from Source + Offset, unused by the write kernels
+    u32*    Offsets;
+} sparse_patches;
+
+typedef enum fragment_distribution
+{
+    FragmentDistribution_Uniform = 0,
+    FragmentDistribution_LogUniform,    // Mostly small fragments with the occasional large one
+} fragment_distribution;
+
+// Gather kernels take a list of these as Src and the fragment count as Count.
+// The destination must be 32-byte aligned and sizes must be multiples of 16,
+// otherwise the streaming stores fault on a misaligned address.
+typedef struct copy_fragment
+{
+    void* Src;
+    umm Size;
+} copy_fragment;
+
+static b32 IsValidGather(umm Count, void* Dst, copy_fragment* Fragments)
+{
+    b32 Result = ((umm)Dst % 32) == 0;
+    for (umm FragmentIndex = 0; FragmentIndex < Count; FragmentIndex++)
+    {
+        Result = Result && (Fragments[FragmentIndex].Size % 16) == 0;
+    }
+    return(Result);
+}
+
 typedef void test_function(umm Count, void* Dst, void* Src);
 
+void WriteSparse8           (umm Count, void* Dst, void* Src);
+void WriteSparse16          (umm Count, void* Dst, void* Src);
+void WriteSparse32          (umm Count, void* Dst, void* Src);
+void WriteSparse64          (umm Count, void* Dst, void* Src);
+void WriteSparse128         (umm Count, void* Dst, void* Src);
+void WriteSparse256         (umm Count, void* Dst, void* Src);
+void CopySparse8            (umm Count, void* Dst, void* Src);
+void CopySparse16           (umm Count, void* Dst, void* Src);
+void CopySparse32           (umm Count, void* Dst, void* Src);
+void CopySparse64           (umm Count, void* Dst, void* Src);
+void CopySparse128          (umm Count, void* Dst, void* Src);
+void CopySparse256          (umm Count, void* Dst, void* Src);
+
+static test_function* GetSparseKernel(umm Granularity, b32 IsCopy)
+{
+    test_function* Result = 0;
+    switch (Granularity)
+    {
+        case 8:     Result = IsCopy ? &CopySparse8   : &WriteSparse8;   break;
+        case 16:    Result = IsCopy ? &CopySparse16  : &WriteSparse16;  break;
+        case 32:    Result = IsCopy ? &CopySparse32  : &WriteSparse32;  break;
+        case 64:    Result = IsCopy ? &CopySparse64  : &WriteSparse64;  break;
+        case 128:   Result = IsCopy ? &CopySparse128 : &WriteSparse128; break;
+        case 256:   Result = IsCopy ? &CopySparse256 : &WriteSparse256; break;
+    }
+    Assert((Result));
+    return(Result);
+}
+
 typedef struct test_context
 {
     u64 TSCFrequencyEstimate;
     umm BufferSize;
     void* Buffers[MemoryType_Count];
     char DeviceName[256];
+
+    // Offset tables, fragment lists, etc.
+    umm ScratchSize;
+    void* Scratch;
+
+    b32 IsBARSimulated;
+    sim_bar SimBAR;
+
+    energy_counters Energy;
 } test_context;
 
 typedef struct test_config
@@ -62,6 +307,19 @@ typedef struct test_config
     umm             Count;
     memory_type     MemoryType;
     test_type       TestType;
+
+    // Sparse tests (Count is the size of the region being patched, Function is picked from Granularity)
+    sparse_pattern  Pattern;
+    umm             Granularity;    // 8 to 256, power of two
+    u32             Density;        // Percent of the region patched
+    test_function*  StreamFunction; // Used by TestType_SparseRebuild
+
+    // Gather tests (Count is the total size of the fragments)
+    fragment_distribution   Distribution;
+    umm                     MinFragmentSize;
+    umm                     MaxFragmentSize;
+
+    u32             RepCount;       // 0 for the default
 } test_config;
 
 typedef struct test_result
@@ -70,8 +328,87 @@ typedef struct test_result
     u64 Max;
     u64 Sum;
     umm DataProcessed;
+    u32 RepCount;
+
+    // Over all reps, only filled in when energy counters are present
+    u64 Elapsed;
+    f64 PackageEnergy;  // Joules
+    f64 DRAMEnergy;
 } test_result;
 
+// Fills the scratch buffer with a sparse_patches header followed by the u32 patch offsets
+// of a sparse test, returns the patch count
+static umm BuildSparseOffsets(test_context* Context, test_config* Test, void* Source)
+{
+    umm PatchCount = (Test->Count * Test->Density) / (100 * Test->Granularity);
+    Assert((PatchCount > 0 && 64 + PatchCount * sizeof(u32) <= Context->ScratchSize));
+
+    sparse_patches* Patches = Context->Scratch;
+    u32* Offsets = (u32*)((u8*)Context->Scratch + 64);
+    Patches->Source = Source;
+    Patches->Offsets = Offsets;
+    switch (Test->Pattern)
+    {
+        case SparsePattern_Strided:
+        {
+            umm Stride = (Test->Count / PatchCount) & ~(umm)7;
+            for (umm PatchIndex = 0; PatchIndex < PatchCount; PatchIndex++)
+            {
+                Offsets[PatchIndex] = (u32)(PatchIndex * Stride);
+            }
+        } break;
+        case SparsePattern_Random:
+        {
+            // Fixed seed so that every run patches the same offsets
+            u64 State = 0x9E3779B97F4A7C15llu;
+            umm SlotCount = (Test->Count - Test->Granularity) / 8 + 1;
+            for (umm PatchIndex = 0; PatchIndex < PatchCount; PatchIndex++)
+            {
+                Offsets[PatchIndex] = (u32)((XorShift64(&State) % SlotCount) * 8);
+            }
+        } break;
+    }
+
+    return(PatchCount);
+}
+
+// Fills the scratch buffer with a fragment list of a gather test, returns the fragment count.
+// Sources are scattered across the host buffer, sizes are rounded to 16 bytes.
+static umm BuildFragments(test_context* Context, test_config* Test)
+{
+    Assert((Test->MinFragmentSize >= 16 && Test->MinFragmentSize <= Test->MaxFragmentSize));
+    Assert(((Test->Count / 16) * sizeof(copy_fragment) <= Context->ScratchSize));
+
+    u64 State = 0x9E3779B97F4A7C15llu;
+    copy_fragment* Fragments = Context->Scratch;
+    u8* Host = Context->Buffers[MemoryType_Host];
+    umm FragmentCount = 0;
+    for (umm Remaining = Test->Count; Remaining; FragmentCount++)
+    {
+        f64 Factor = (f64)(XorShift64(&State) >> 11) / (f64)(1llu << 53);
+        f64 Size = 0.0;
+        switch (Test->Distribution)
+        {
+            case FragmentDistribution_Uniform:
+            {
+                Size = Test->MinFragmentSize + Factor * (f64)(Test->MaxFragmentSize - Test->MinFragmentSize);
+            } break;
+            case FragmentDistribution_LogUniform:
+            {
+                Size = Test->MinFragmentSize * pow((f64)Test->MaxFragmentSize / (f64)Test->MinFragmentSize, Factor);
+            } break;
+        }
+
+        umm FragmentSize = Min(((umm)Size + 15) & ~(umm)15, Remaining);
+        umm SrcOffset = (XorShift64(&State) % ((Context->BufferSize - FragmentSize) / 16 + 1)) * 16;
+        Fragments[FragmentCount].Src = Host + SrcOffset;
+        Fragments[FragmentCount].Size = FragmentSize;
+        Remaining -= FragmentSize;
+    }
+
+    return(FragmentCount);
+}
+
 static test_result RunTest(test_context* Context, test_config* Test)
 {
     Assert(Context->BufferSize >= Test->Count);
@@ -80,6 +417,8 @@ static test_result RunTest(test_context* Context, test_config* Test)
     Result.DataProcessed = Test->Count;
     Result.Min = ~(0llu);
 
+    umm Count = Test->Count;
+    test_function* Function = Test->Function;
     void* Dst = 0;
     void* Src = 0;
     switch (Test->TestType)
@@ -93,13 +432,78 @@ static test_result RunTest(test_context* Context, test_config* Test)
             Dst = Context->Buffers[MemoryType_BAR];
             Src = Context->Buffers[MemoryType_Host];
         } break;
+        case TestType_SparseWrite:
+        case TestType_SparseCopy:
+        case TestType_SparseRebuild:
+        {
+            // All variants end up with the same fields updated, so report the patched bytes for each.
+            // Rebuild patches its host copy with the write kernel, the host buffer is the copy itself.
+            Count = BuildSparseOffsets(Context, Test, Context->Buffers[MemoryType_Host]);
+            Function = GetSparseKernel(Test->Granularity, Test->TestType == TestType_SparseCopy);
+            Result.DataProcessed = Count * Test->Granularity;
+            Dst = Context->Buffers[MemoryType_BAR];
+            Src = Context->Scratch;
+        } break;
+        case TestType_Gather:
+        {
+            Count = BuildFragments(Context, Test);
+            Dst = Context->Buffers[MemoryType_BAR];
+            Src = Context->Scratch;
+            Assert((IsValidGather(Count, Dst, Src)));
+        } break;
+    }
+
+    // The modeled time only depends on the written ranges, so work it out once outside the timed region
+    u64 SimulatedCycles = 0;
+    b32 SimulateBAR = Context->IsBARSimulated && (Dst == Context->Buffers[MemoryType_BAR]);
+    if (SimulateBAR)
+    {
+        SimBARBegin(&Context->SimBAR);
+        if (Test->TestType == TestType_SparseWrite || Test->TestType == TestType_SparseCopy)
+        {
+            sparse_patches* Patches = Src;
+            for (umm PatchIndex = 0; PatchIndex < Count; PatchIndex++)
+            {
+                SimBARWrite(&Context->SimBAR, Patches->Offsets[PatchIndex], Test->Granularity);
+            }
+        }
+        else
+        {
+            SimBARWrite(&Context->SimBAR, 0, Test->Count);
+        }
+        SimulatedCycles = SimBAREnd(&Context->SimBAR);
     }
 
-    const u32 RepCount = 4096;
+    const u32 RepCount = Test->RepCount ? Test->RepCount : 4096;
+    Result.RepCount = RepCount;
+
+    energy_sample EnergyBegin = {0};
+    if (Context->Energy.IsPresent)
+    {
+        EnergyBegin = SampleEnergy();
+    }
+    u64 TestBegin = __rdtsc();
+
     for (u32 Rep = 0; Rep < RepCount; Rep++)
     {
         u64 Begin = __rdtsc();
-        Test->Function(Test->Count, Dst, Src);
+        if (Test->TestType == TestType_SparseRebuild)
+        {
+            void* Shadow = Context->Buffers[MemoryType_Host];
+            Function(Count, Shadow, Src);
+            Test->StreamFunction(Test->Count, Dst, Shadow);
+        }
+        else
+        {
+            Function(Count, Dst, Src);
+        }
+        if (SimulateBAR)
+        {
+            while (__rdtsc() - Begin < SimulatedCycles)
+            {
+                _mm_pause();
+            }
+        }
         u64 End = __rdtsc();
         u64 Delta = End - Begin;
 
@@ -108,12 +512,182 @@ static test_result RunTest(test_context* Context, test_config* Test)
         Result.Sum += Delta;
     }
 
+    if (Context->Energy.IsPresent)
+    {
+        Result.Elapsed = __rdtsc() - TestBegin;
+        energy_sample EnergyEnd = SampleEnergy();
+        Result.PackageEnergy = EnergyEnd.Package - EnergyBegin.Package;
+        Result.DRAMEnergy = EnergyEnd.DRAM - EnergyBegin.DRAM;
+    }
+
+    return(Result);
+}
+
+static void PrintTestResult(test_context* Context, test_config* Test, test_result* Result)
+{
     f64 GhzConv = Context->TSCFrequencyEstimate / (1000.0 * 1000.0 * 1000.0);
     printf("=== %s\nMin:\t%f c/b (%f GB/s)\nMax:\t%f c/b (%f GB/s)\nSum:\t%f c/b (%f GB/s)\n",
            Test->Name, 
-           Result.Min / (f64)Result.DataProcessed, GhzConv * (f64)Result.DataProcessed / (f64)Result.Min,
-           Result.Max / (f64)Result.DataProcessed, GhzConv * (f64)Result.DataProcessed / (f64)Result.Max,
-           Result.Sum / ((f64)Result.DataProcessed * RepCount), GhzConv * (f64)Result.DataProcessed * RepCount / (f64)Result.Sum);
+           Result->Min / (f64)Result->DataProcessed, GhzConv * (f64)Result->DataProcessed / (f64)Result->Min,
+           Result->Max / (f64)Result->DataProcessed, GhzConv * (f64)Result->DataProcessed / (f64)Result->Max,
+           Result->Sum / ((f64)Result->DataProcessed * Result->RepCount), GhzConv * (f64)Result->DataProcessed * Result->RepCount / (f64)Result->Sum);
+
+    if (Context->Energy.IsPresent)
+    {
+        f64 GiBProcessed = (f64)Result->DataProcessed * Result->RepCount / (f64)MiB(1024);
+        f64 Seconds = (f64)Result->Elapsed / (f64)Context->TSCFrequencyEstimate;
+        if (Context->Energy.HasDRAM)
+        {
+            printf("Energy:\t%f J/GiB (%f W package, %f W DRAM)\n",
+                   (Result->PackageEnergy + Result->DRAMEnergy) / GiBProcessed,
+                   Result->PackageEnergy / Seconds, Result->DRAMEnergy / Seconds);
+        }
+        else
+        {
+            printf("Energy:\t%f J/GiB (%f W package)\n",
+                   Result->PackageEnergy / GiBProcessed, Result->PackageEnergy / Seconds);
+        }
+    }
+}
+
+//
+// Kernel generator
+//
+// Emits write/copy loops with the same interface and register usage as the
+// kernels in write.asm (rcx: byte count, rdx: destination, r8: source), so
+// that the parameter space can be searched without editing the assembly.
+//
+typedef enum kernel_op
+{
+    KernelOp_Write = 0,
+    KernelOp_Copy,
+} kernel_op;
+
+typedef struct kernel_params
+{
+    kernel_op   Op;
+    u32         Unroll;         // Stores per iteration
+    u32         Width;          // Bytes per store, 16 (xmm) or 32 (ymm)
+    b32         NonTemporal;
+    u32         LoopAlignment;  // 16, 32 or 64, the loop head is placed at exactly this alignment
+} kernel_params;
+
+typedef struct code_buffer
+{
+    u8* Base;
+    umm Size;
+    umm Used;
+} code_buffer;
+
+static void* AllocateCodeMemory(umm Size);
+static void ProtectCodeMemory(void* Memory, umm Size);
+
+static void EmitByte(code_buffer* Code, u8 Byte)
+{
+    Assert((Code->Used < Code->Size));
+    Code->Base[Code->Used++] = Byte;
+}
+
+static void EmitU32(code_buffer* Code, u32 Value)
+{
+    for (u32 ByteIndex = 0; ByteIndex < 4; ByteIndex++)
+    {
+        EmitByte(Code, (u8)(Value >> (8 * ByteIndex)));
+    }
+}
+
+// ModRM + displacement for [Base + Displacement] with xmm0/ymm0 as the register operand
+static void EmitMemoryOperand(code_buffer* Code, u8 Base, u32 Displacement)
+{
+    if (Displacement == 0)
+    {
+        EmitByte(Code, Base);
+    }
+    else if (Displacement < 128)
+    {
+        EmitByte(Code, 0x40 | Base);
+        EmitByte(Code, (u8)Displacement);
+    }
+    else
+    {
+        EmitByte(Code, 0x80 | Base);
+        EmitU32(Code, Displacement);
+    }
+}
+
+static test_function* GenerateKernel(code_buffer* Code, kernel_params Params)
+{
+    const u8 RDX = 0x02;
+    const u8 R8 = 0x00;
+
+    // Loop alignment is relative to the code buffer, so start every kernel on a cache line
+    while (Code->Used % 64)
+    {
+        EmitByte(Code, 0xCC);
+    }
+    test_function* Result = (test_function*)(Code->Base + Code->Used);
+
+    u8 L = (Params.Width == 32) ? 0x04 : 0x00;
+    if (Params.Op == KernelOp_Write)
+    {
+        // vxorps v0, v0, v0
+        EmitByte(Code, 0xC5); EmitByte(Code, 0xF8 | L); EmitByte(Code, 0x57); EmitByte(Code, 0xC0);
+    }
+
+    while ((Code->Used % 64) != (Params.LoopAlignment % 64))
+    {
+        EmitByte(Code, 0x90);
+    }
+
+    umm Loop = Code->Used;
+    for (u32 Index = 0; Index < Params.Unroll; Index++)
+    {
+        u32 Displacement = Index * Params.Width;
+        if (Params.Op == KernelOp_Copy)
+        {
+            // vmovdqu v0, [r8 + Displacement]
+            EmitByte(Code, 0xC4); EmitByte(Code, 0xC1); EmitByte(Code, 0x7A | L); EmitByte(Code, 0x6F);
+            EmitMemoryOperand(Code, R8, Displacement);
+        }
+
+        if (Params.NonTemporal)
+        {
+            // vmovntdq [rdx + Displacement], v0
+            EmitByte(Code, 0xC5); EmitByte(Code, 0xF9 | L); EmitByte(Code, 0xE7);
+        }
+        else
+        {
+            // vmovups [rdx + Displacement], v0
+            EmitByte(Code, 0xC5); EmitByte(Code, 0xF8 | L); EmitByte(Code, 0x11);
+        }
+        EmitMemoryOperand(Code, RDX, Displacement);
+    }
+
+    u32 Step = Params.Unroll * Params.Width;
+
+    // add rdx, Step
+    EmitByte(Code, 0x48); EmitByte(Code, 0x81); EmitByte(Code, 0xC2); EmitU32(Code, Step);
+    if (Params.Op == KernelOp_Copy)
+    {
+        // add r8, Step
+        EmitByte(Code, 0x49); EmitByte(Code, 0x81); EmitByte(Code, 0xC0); EmitU32(Code, Step);
+    }
+    // sub rcx, Step
+    EmitByte(Code, 0x48); EmitByte(Code, 0x81); EmitByte(Code, 0xE9); EmitU32(Code, Step);
+
+    // jnz Loop
+    smm Rel8 = (smm)Loop - (smm)(Code->Used + 2);
+    if (Rel8 >= -128)
+    {
+        EmitByte(Code, 0x75); EmitByte(Code, (u8)Rel8);
+    }
+    else
+    {
+        EmitByte(Code, 0x0F); EmitByte(Code, 0x85); EmitU32(Code, (u32)((smm)Loop - (smm)(Code->Used + 4)));
+    }
+
+    // ret
+    EmitByte(Code, 0xC3);
 
     return(Result);
 }
@@ -130,10 +704,49 @@ void WriteNonTemporal32x4   (umm Count, void* Dst, void* Src);
 void Copy32x4               (umm Count, void* Dst, void* Src);
 void CopyNonTemporal32x4    (umm Count, void* Dst, void* Src);
 
+// Count: number of fragments, Src: copy_fragment list, see IsValidGather for the requirements
+void CopyGatherNonTemporal32x4(umm Count, void* Dst, void* Src);
+
+// Baseline for the gather kernel: a separate call per fragment through the same copy loop,
+// so the difference between the two is the per-call overhead
+static void CopyFragmentsNonTemporal32x4(umm Count, void* Dst, void* Src)
+{
+    copy_fragment* Fragments = Src;
+    u8* At = Dst;
+    for (umm FragmentIndex = 0; FragmentIndex < Count; FragmentIndex++)
+    {
+        CopyGatherNonTemporal32x4(1, At, Fragments + FragmentIndex);
+        At += Fragments[FragmentIndex].Size;
+    }
+}
+
 #define TestCopyTemporal        1
 #define TestCopyNonTemporal     1
 #define TestWriteNonTemporal    0
 #define TestWriteTemporal       0
+#define TestSparse              0
+#define TestGather              0
+
+// Search generated kernels for the best one per size class instead of running Tests (needs the real BAR)
+#define RunAutotune             0
+
+// Report energy per GiB and average power from the RAPL counters exposed through the Energy Meter Interface
+#define MeasureEnergy           0
+// Fall back to reading the package MSRs through the WinRing0 driver when EMI isn't available.
+// Needs admin rights, and the driver is on the Windows vulnerable driver blocklist (CVE-2020-14979).
+#define MeasureEnergyWinRing0   0
+
+// Replace the Vulkan BAR mapping with host memory going through the link model
+#define UseSimulatedBAR         0
+
+static sim_bar_config SimBARConfig = 
+{
+    .LinkBandwidth          = 12.0e9,
+    .PostedWriteLatency     = 80.0e-9,
+    .BufferCount            = 10,
+    .TransactionOverhead    = 24,
+    .PartialChunkSize       = 8,
+};
 
 static test_config Tests[] = 
 {
@@ -239,6 +852,120 @@ static test_config Tests[] =
     { "Bar 64MiB  [32x4]", &Write32x4, MiB(64),    MemoryType_BAR, TestType_Write },
 #endif
 
+#if TestSparse
+    { "Patch Strided 4MiB  1% 8B   [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Strided,   8,  1, 0 },
+    { "Patch Strided 4MiB  1% 8B   [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Strided,   8,  1, 0 },
+    { "Patch Strided 4MiB  1% 8B   [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Strided,   8,  1, &CopyNonTemporal32x4 },
+    { "Patch Strided 4MiB  1% 16B  [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Strided,  16,  1, 0 },
+    { "Patch Strided 4MiB  1% 16B  [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Strided,  16,  1, 0 },
+    { "Patch Strided 4MiB  1% 16B  [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Strided,  16,  1, &CopyNonTemporal32x4 },
+    { "Patch Strided 4MiB  1% 32B  [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Strided,  32,  1, 0 },
+    { "Patch Strided 4MiB  1% 32B  [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Strided,  32,  1, 0 },
+    { "Patch Strided 4MiB  1% 32B  [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Strided,  32,  1, &CopyNonTemporal32x4 },
+    { "Patch Strided 4MiB  1% 64B  [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Strided,  64,  1, 0 },
+    { "Patch Strided 4MiB  1% 64B  [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Strided,  64,  1, 0 },
+    { "Patch Strided 4MiB  1% 64B  [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Strided,  64,  1, &CopyNonTemporal32x4 },
+    { "Patch Strided 4MiB  1% 128B [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Strided, 128,  1, 0 },
+    { "Patch Strided 4MiB  1% 128B [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Strided, 128,  1, 0 },
+    { "Patch Strided 4MiB  1% 128B [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Strided, 128,  1, &CopyNonTemporal32x4 },
+    { "Patch Strided 4MiB  1% 256B [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Strided, 256,  1, 0 },
+    { "Patch Strided 4MiB  1% 256B [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Strided, 256,  1, 0 },
+    { "Patch Strided 4MiB  1% 256B [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Strided, 256,  1, &CopyNonTemporal32x4 },
+
+    { "Patch Strided 4MiB 10% 8B   [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Strided,   8, 10, 0 },
+    { "Patch Strided 4MiB 10% 8B   [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Strided,   8, 10, 0 },
+    { "Patch Strided 4MiB 10% 8B   [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Strided,   8, 10, &CopyNonTemporal32x4 },
+    { "Patch Strided 4MiB 10% 16B  [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Strided,  16, 10, 0 },
+    { "Patch Strided 4MiB 10% 16B  [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Strided,  16, 10, 0 },
+    { "Patch Strided 4MiB 10% 16B  [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Strided,  16, 10, &CopyNonTemporal32x4 },
+    { "Patch Strided 4MiB 10% 32B  [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Strided,  32, 10, 0 },
+    { "Patch Strided 4MiB 10% 32B  [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Strided,  32, 10, 0 },
+    { "Patch Strided 4MiB 10% 32B  [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Strided,  32, 10, &CopyNonTemporal32x4 },
+    { "Patch Strided 4MiB 10% 64B  [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Strided,  64, 10, 0 },
+    { "Patch Strided 4MiB 10% 64B  [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Strided,  64, 10, 0 },
+    { "Patch Strided 4MiB 10% 64B  [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Strided,  64, 10, &CopyNonTemporal32x4 },
+    { "Patch Strided 4MiB 10% 128B [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Strided, 128, 10, 0 },
+    { "Patch Strided 4MiB 10% 128B [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Strided, 128, 10, 0 },
+    { "Patch Strided 4MiB 10% 128B [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Strided, 128, 10, &CopyNonTemporal32x4 },
+    { "Patch Strided 4MiB 10% 256B [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Strided, 256, 10, 0 },
+    { "Patch Strided 4MiB 10% 256B [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Strided, 256, 10, 0 },
+    { "Patch Strided 4MiB 10% 256B [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Strided, 256, 10, &CopyNonTemporal32x4 },
+
+    { "Patch Random  4MiB  1% 8B   [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Random,   8,  1, 0 },
+    { "Patch Random  4MiB  1% 8B   [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Random,   8,  1, 0 },
+    { "Patch Random  4MiB  1% 8B   [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Random,   8,  1, &CopyNonTemporal32x4 },
+    { "Patch Random  4MiB  1% 16B  [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Random,  16,  1, 0 },
+    { "Patch Random  4MiB  1% 16B  [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Random,  16,  1, 0 },
+    { "Patch Random  4MiB  1% 16B  [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Random,  16,  1, &CopyNonTemporal32x4 },
+    { "Patch Random  4MiB  1% 32B  [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Random,  32,  1, 0 },
+    { "Patch Random  4MiB  1% 32B  [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Random,  32,  1, 0 },
+    { "Patch Random  4MiB  1% 32B  [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Random,  32,  1, &CopyNonTemporal32x4 },
+    { "Patch Random  4MiB  1% 64B  [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Random,  64,  1, 0 },
+    { "Patch Random  4MiB  1% 64B  [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Random,  64,  1, 0 },
+    { "Patch Random  4MiB  1% 64B  [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Random,  64,  1, &CopyNonTemporal32x4 },
+    { "Patch Random  4MiB  1% 128B [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Random, 128,  1, 0 },
+    { "Patch Random  4MiB  1% 128B [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Random, 128,  1, 0 },
+    { "Patch Random  4MiB  1% 128B [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Random, 128,  1, &CopyNonTemporal32x4 },
+    { "Patch Random  4MiB  1% 256B [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Random, 256,  1, 0 },
+    { "Patch Random  4MiB  1% 256B [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Random, 256,  1, 0 },
+    { "Patch Random  4MiB  1% 256B [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Random, 256,  1, &CopyNonTemporal32x4 },
+
+    { "Patch Random  4MiB 10% 8B   [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Random,   8, 10, 0 },
+    { "Patch Random  4MiB 10% 8B   [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Random,   8, 10, 0 },
+    { "Patch Random  4MiB 10% 8B   [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Random,   8, 10, &CopyNonTemporal32x4 },
+    { "Patch Random  4MiB 10% 16B  [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Random,  16, 10, 0 },
+    { "Patch Random  4MiB 10% 16B  [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Random,  16, 10, 0 },
+    { "Patch Random  4MiB 10% 16B  [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Random,  16, 10, &CopyNonTemporal32x4 },
+    { "Patch Random  4MiB 10% 32B  [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Random,  32, 10, 0 },
+    { "Patch Random  4MiB 10% 32B  [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Random,  32, 10, 0 },
+    { "Patch Random  4MiB 10% 32B  [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Random,  32, 10, &CopyNonTemporal32x4 },
+    { "Patch Random  4MiB 10% 64B  [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Random,  64, 10, 0 },
+    { "Patch Random  4MiB 10% 64B  [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Random,  64, 10, 0 },
+    { "Patch Random  4MiB 10% 64B  [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Random,  64, 10, &CopyNonTemporal32x4 },
+    { "Patch Random  4MiB 10% 128B [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Random, 128, 10, 0 },
+    { "Patch Random  4MiB 10% 128B [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Random, 128, 10, 0 },
+    { "Patch Random  4MiB 10% 128B [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Random, 128, 10, &CopyNonTemporal32x4 },
+    { "Patch Random  4MiB 10% 256B [Write  ]", 0, MiB(4), MemoryType_BAR, TestType_SparseWrite,    SparsePattern_Random, 256, 10, 0 },
+    { "Patch Random  4MiB 10% 256B [Copy   ]", 0, MiB(4), MemoryType_BAR, TestType_SparseCopy,     SparsePattern_Random, 256, 10, 0 },
+    { "Patch Random  4MiB 10% 256B [Rebuild]", 0, MiB(4), MemoryType_BAR, TestType_SparseRebuild,  SparsePattern_Random, 256, 10, &CopyNonTemporal32x4 },
+#endif
+
+#if TestGather
+    { "Gather 64KiB 32B           [Gather]", &CopyGatherNonTemporal32x4,    KiB(64), MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =   32, .MaxFragmentSize =    32 },
+    { "Gather 64KiB 32B           [Calls ]", &CopyFragmentsNonTemporal32x4, KiB(64), MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =   32, .MaxFragmentSize =    32 },
+    { "Gather 64KiB 48B           [Gather]", &CopyGatherNonTemporal32x4,    KiB(64), MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =   48, .MaxFragmentSize =    48 },
+    { "Gather 64KiB 48B           [Calls ]", &CopyFragmentsNonTemporal32x4, KiB(64), MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =   48, .MaxFragmentSize =    48 },
+    { "Gather 64KiB 128B          [Gather]", &CopyGatherNonTemporal32x4,    KiB(64), MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =  128, .MaxFragmentSize =   128 },
+    { "Gather 64KiB 128B          [Calls ]", &CopyFragmentsNonTemporal32x4, KiB(64), MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =  128, .MaxFragmentSize =   128 },
+    { "Gather 64KiB 256B          [Gather]", &CopyGatherNonTemporal32x4,    KiB(64), MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =  256, .MaxFragmentSize =   256 },
+    { "Gather 64KiB 256B          [Calls ]", &CopyFragmentsNonTemporal32x4, KiB(64), MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =  256, .MaxFragmentSize =   256 },
+    { "Gather 64KiB 1KiB          [Gather]", &CopyGatherNonTemporal32x4,    KiB(64), MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize = 1024, .MaxFragmentSize =  1024 },
+    { "Gather 64KiB 1KiB          [Calls ]", &CopyFragmentsNonTemporal32x4, KiB(64), MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize = 1024, .MaxFragmentSize =  1024 },
+    { "Gather 64KiB 32B-256B      [Gather]", &CopyGatherNonTemporal32x4,    KiB(64), MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =   32, .MaxFragmentSize =   256 },
+    { "Gather 64KiB 32B-256B      [Calls ]", &CopyFragmentsNonTemporal32x4, KiB(64), MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =   32, .MaxFragmentSize =   256 },
+    { "Gather 64KiB 128B-1KiB     [Gather]", &CopyGatherNonTemporal32x4,    KiB(64), MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =  128, .MaxFragmentSize =  1024 },
+    { "Gather 64KiB 128B-1KiB     [Calls ]", &CopyFragmentsNonTemporal32x4, KiB(64), MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =  128, .MaxFragmentSize =  1024 },
+    { "Gather 64KiB 32B-16KiB log [Gather]", &CopyGatherNonTemporal32x4,    KiB(64), MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_LogUniform, .MinFragmentSize =   32, .MaxFragmentSize = 16384 },
+    { "Gather 64KiB 32B-16KiB log [Calls ]", &CopyFragmentsNonTemporal32x4, KiB(64), MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_LogUniform, .MinFragmentSize =   32, .MaxFragmentSize = 16384 },
+
+    { "Gather 1MiB  32B           [Gather]", &CopyGatherNonTemporal32x4,    MiB(1),  MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =   32, .MaxFragmentSize =    32 },
+    { "Gather 1MiB  32B           [Calls ]", &CopyFragmentsNonTemporal32x4, MiB(1),  MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =   32, .MaxFragmentSize =    32 },
+    { "Gather 1MiB  48B           [Gather]", &CopyGatherNonTemporal32x4,    MiB(1),  MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =   48, .MaxFragmentSize =    48 },
+    { "Gather 1MiB  48B           [Calls ]", &CopyFragmentsNonTemporal32x4, MiB(1),  MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =   48, .MaxFragmentSize =    48 },
+    { "Gather 1MiB  128B          [Gather]", &CopyGatherNonTemporal32x4,    MiB(1),  MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =  128, .MaxFragmentSize =   128 },
+    { "Gather 1MiB  128B          [Calls ]", &CopyFragmentsNonTemporal32x4, MiB(1),  MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =  128, .MaxFragmentSize =   128 },
+    { "Gather 1MiB  256B          [Gather]", &CopyGatherNonTemporal32x4,    MiB(1),  MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =  256, .MaxFragmentSize =   256 },
+    { "Gather 1MiB  256B          [Calls ]", &CopyFragmentsNonTemporal32x4, MiB(1),  MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =  256, .MaxFragmentSize =   256 },
+    { "Gather 1MiB  1KiB          [Gather]", &CopyGatherNonTemporal32x4,    MiB(1),  MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize = 1024, .MaxFragmentSize =  1024 },
+    { "Gather 1MiB  1KiB          [Calls ]", &CopyFragmentsNonTemporal32x4, MiB(1),  MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize = 1024, .MaxFragmentSize =  1024 },
+    { "Gather 1MiB  32B-256B      [Gather]", &CopyGatherNonTemporal32x4,    MiB(1),  MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =   32, .MaxFragmentSize =   256 },
+    { "Gather 1MiB  32B-256B      [Calls ]", &CopyFragmentsNonTemporal32x4, MiB(1),  MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =   32, .MaxFragmentSize =   256 },
+    { "Gather 1MiB  128B-1KiB     [Gather]", &CopyGatherNonTemporal32x4,    MiB(1),  MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =  128, .MaxFragmentSize =  1024 },
+    { "Gather 1MiB  128B-1KiB     [Calls ]", &CopyFragmentsNonTemporal32x4, MiB(1),  MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_Uniform,    .MinFragmentSize =  128, .MaxFragmentSize =  1024 },
+    { "Gather 1MiB  32B-16KiB log [Gather]", &CopyGatherNonTemporal32x4,    MiB(1),  MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_LogUniform, .MinFragmentSize =   32, .MaxFragmentSize = 16384 },
+    { "Gather 1MiB  32B-16KiB log [Calls ]", &CopyFragmentsNonTemporal32x4, MiB(1),  MemoryType_BAR, TestType_Gather, .Distribution = FragmentDistribution_LogUniform, .MinFragmentSize =   32, .MaxFragmentSize = 16384 },
+#endif
+
     // Unused
 #if 0
     { "Mem 4KiB   [32x2]", &Write32x2, KiB(4),     MemoryType_Host, TestType_Write },
@@ -305,6 +1032,227 @@ static test_config Tests[] =
 #endif
 };
 
+static umm AutotuneSizes[]       = { KiB(4), KiB(16), KiB(64), KiB(256), MiB(1), MiB(4), MiB(16) };
+static u32 AutotuneUnrolls[]     = { 1, 2, 4, 8 };
+static u32 AutotuneWidths[]      = { 16, 32 };
+static u32 AutotuneAlignments[]  = { 16, 32, 64 };
+
+static void FormatSize(char* Buffer, umm BufferSize, umm Size)
+{
+    if (Size >= MiB(1))
+    {
+        snprintf(Buffer, BufferSize, "%lluMiB", (u64)(Size >> 20));
+    }
+    else
+    {
+        snprintf(Buffer, BufferSize, "%lluKiB", (u64)(Size >> 10));
+    }
+}
+
+static void WriteKernelSource(FILE* File, const char* Name, kernel_params Params)
+{
+    const char* Register = (Params.Width == 32) ? "ymm0" : "xmm0";
+    const char* Store = Params.NonTemporal ? "vmovntdq" : "vmovups";
+
+    fprintf(File, "%s:\n", Name);
+    if (Params.Op == KernelOp_Write)
+    {
+        fprintf(File, "    vxorps %s, %s\n", Register, Register);
+    }
+    fprintf(File, "    align 64\n");
+    if (Params.LoopAlignment % 64)
+    {
+        fprintf(File, "    times %u nop\n", Params.LoopAlignment % 64);
+    }
+    fprintf(File, ".loop:\n");
+    for (u32 Index = 0; Index < Params.Unroll; Index++)
+    {
+        u32 Displacement = Index * Params.Width;
+        if (Params.Op == KernelOp_Copy)
+        {
+            if (Displacement)
+            {
+                fprintf(File, "    vmovdqu %s, [r8 + %u]\n", Register, Displacement);
+            }
+            else
+            {
+                fprintf(File, "    vmovdqu %s, [r8]\n", Register);
+            }
+        }
+
+        if (Displacement)
+        {
+            fprintf(File, "    %s [rdx + %u], %s\n", Store, Displacement, Register);
+        }
+        else
+        {
+            fprintf(File, "    %s [rdx], %s\n", Store, Register);
+        }
+    }
+    fprintf(File, "    add rdx, %u\n", Params.Unroll * Params.Width);
+    if (Params.Op == KernelOp_Copy)
+    {
+        fprintf(File, "    add r8, %u\n", Params.Unroll * Params.Width);
+    }
+    fprintf(File, "    sub rcx, %u\n", Params.Unroll * Params.Width);
+    fprintf(File, "    jnz .loop\n");
+    fprintf(File, "    ret\n\n");
+}
+
+// Benchmarks every generated variant against the BAR for each size class, and exports
+// all measurements to autotune.csv and the winners as NASM source to autotune.asm
+static void Autotune(test_context* Context)
+{
+    enum { KernelCount = 2 * CountOf(AutotuneUnrolls) * CountOf(AutotuneWidths) * 2 * CountOf(AutotuneAlignments) };
+    enum { WinnerCount = 2 * CountOf(AutotuneSizes) };
+
+    // The simulated link only looks at the byte count, so every variant would tie
+    if (Context->IsBARSimulated)
+    {
+        fprintf(stderr, "Autotuning skipped: the simulated BAR hides the differences between kernels\n");
+        return;
+    }
+
+    kernel_params Params[KernelCount];
+    test_function* Kernels[KernelCount];
+
+    code_buffer Code = { 0 };
+    Code.Size = KiB(64);
+    Code.Base = AllocateCodeMemory(Code.Size);
+    if (!Code.Base)
+    {
+        fprintf(stderr, "Failed to allocate code memory");
+        return;
+    }
+
+    u32 KernelIndex = 0;
+    for (kernel_op Op = KernelOp_Write; Op <= KernelOp_Copy; Op++)
+    {
+        for (u32 UnrollIndex = 0; UnrollIndex < CountOf(AutotuneUnrolls); UnrollIndex++)
+        {
+            for (u32 WidthIndex = 0; WidthIndex < CountOf(AutotuneWidths); WidthIndex++)
+            {
+                for (b32 NonTemporal = 0; NonTemporal <= 1; NonTemporal++)
+                {
+                    for (u32 AlignmentIndex = 0; AlignmentIndex < CountOf(AutotuneAlignments); AlignmentIndex++)
+                    {
+                        kernel_params* Kernel = Params + KernelIndex;
+                        Kernel->Op              = Op;
+                        Kernel->Unroll          = AutotuneUnrolls[UnrollIndex];
+                        Kernel->Width           = AutotuneWidths[WidthIndex];
+                        Kernel->NonTemporal     = NonTemporal;
+                        Kernel->LoopAlignment   = AutotuneAlignments[AlignmentIndex];
+                        Kernels[KernelIndex] = GenerateKernel(&Code, *Kernel);
+                        KernelIndex++;
+                    }
+                }
+            }
+        }
+    }
+    ProtectCodeMemory(Code.Base, Code.Size);
+
+    FILE* CSV = fopen("autotune.csv", "w");
+    if (CSV)
+    {
+        fprintf(CSV, "Op,Size,Unroll,Width,NonTemporal,LoopAlignment,MinGBps,AvgGBps%s\n",
+                Context->Energy.IsPresent ? ",JoulesPerGiB" : "");
+    }
+
+    f64 GhzConv = Context->TSCFrequencyEstimate / (1000.0 * 1000.0 * 1000.0);
+    char Names[WinnerCount][64];
+    kernel_params Winners[WinnerCount];
+    f64 WinnerBandwidths[WinnerCount];
+    u32 WinnerIndex = 0;
+    for (kernel_op Op = KernelOp_Write; Op <= KernelOp_Copy; Op++)
+    {
+        const char* OpName = (Op == KernelOp_Write) ? "Write" : "Copy";
+        for (u32 SizeIndex = 0; SizeIndex < CountOf(AutotuneSizes); SizeIndex++)
+        {
+            umm Size = AutotuneSizes[SizeIndex];
+            char SizeName[16];
+            FormatSize(SizeName, sizeof(SizeName), Size);
+
+            f64 BestAvg = 0.0;
+            f64 BestMin = 0.0;
+            u32 Best = 0;
+            for (KernelIndex = 0; KernelIndex < KernelCount; KernelIndex++)
+            {
+                if (Params[KernelIndex].Op != Op)
+                {
+                    continue;
+                }
+
+                test_config Test = 
+                {
+                    .Name       = "Autotune",
+                    .Function   = Kernels[KernelIndex],
+                    .Count      = Size,
+                    .MemoryType = MemoryType_BAR,
+                    .TestType   = (Op == KernelOp_Write) ? TestType_Write : TestType_Copy,
+                    .RepCount   = (u32)Max(16, Min(4096, MiB(64) / Size)),
+                };
+                test_result Result = RunTest(Context, &Test);
+
+                f64 MinBandwidth = GhzConv * (f64)Result.DataProcessed / (f64)Result.Min;
+                f64 AvgBandwidth = GhzConv * (f64)Result.DataProcessed * Result.RepCount / (f64)Result.Sum;
+                if (AvgBandwidth > BestAvg)
+                {
+                    BestAvg = AvgBandwidth;
+                    BestMin = MinBandwidth;
+                    Best = KernelIndex;
+                }
+
+                if (CSV)
+                {
+                    kernel_params* Kernel = Params + KernelIndex;
+                    fprintf(CSV, "%s,%llu,%u,%u,%u,%u,%f,%f",
+                            OpName, (u64)Size, Kernel->Unroll, Kernel->Width, Kernel->NonTemporal, Kernel->LoopAlignment, MinBandwidth, AvgBandwidth);
+                    if (Context->Energy.IsPresent)
+                    {
+                        f64 GiBProcessed = (f64)Result.DataProcessed * Result.RepCount / (f64)MiB(1024);
+                        fprintf(CSV, ",%f", (Result.PackageEnergy + Result.DRAMEnergy) / GiBProcessed);
+                    }
+                    fprintf(CSV, "\n");
+                }
+            }
+
+            kernel_params* Kernel = Params + Best;
+            printf("=== %s %s\nBest:\t[%ux%u%s @%u] %f GB/s avg (%f GB/s min)\n",
+                   OpName, SizeName,
+                   Kernel->Width, Kernel->Unroll, Kernel->NonTemporal ? " NT" : "", Kernel->LoopAlignment,
+                   BestAvg, BestMin);
+
+            snprintf(Names[WinnerIndex], sizeof(Names[WinnerIndex]), "Autotuned%s%s", OpName, SizeName);
+            Winners[WinnerIndex] = *Kernel;
+            WinnerBandwidths[WinnerIndex] = BestAvg;
+            WinnerIndex++;
+        }
+    }
+
+    if (CSV)
+    {
+        fclose(CSV);
+    }
+
+    FILE* Source = fopen("autotune.asm", "w");
+    if (Source)
+    {
+        fprintf(Source, "; Generated by barbandwidth autotune on %s\n\n", Context->DeviceName);
+        for (u32 Index = 0; Index < WinnerIndex; Index++)
+        {
+            fprintf(Source, "global %s\n", Names[Index]);
+        }
+        // Win64 COFF sections default to 16-byte alignment, which would not preserve the tuned loop placement
+        fprintf(Source, "\nsection .text align=64\n\n");
+        for (u32 Index = 0; Index < WinnerIndex; Index++)
+        {
+            fprintf(Source, "; %f GB/s avg\n", WinnerBandwidths[Index]);
+            WriteKernelSource(Source, Names[Index], Winners[Index]);
+        }
+        fclose(Source);
+    }
+}
+
 static test_context Initialize(void);
 
 int main(void)
@@ -325,15 +1273,20 @@ int main(void)
         printf("Device: %s\n", Context.DeviceName);
         printf("Frequency estimate: %f Ghz\n", Context.TSCFrequencyEstimate / (1000.0 * 1000.0 * 1000.0));
 
+#if RunAutotune
+        Autotune(&Context);
+#else
         //for (;;)
         {
             for (u32 TestIndex = 0; TestIndex < CountOf(Tests); TestIndex++)
             {
                 test_config* Test = Tests + TestIndex;
-                RunTest(&Context, Test);
+                test_result Result = RunTest(&Context, Test);
+                PrintTestResult(&Context, Test, &Result);
             }
             printf("- - - - - - - - - - - - - - - - -\n");
         }
+#endif
     }
     else
     {
@@ -349,6 +1302,9 @@ int main(void)
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
 #include <Windows.h>
+#include <SetupAPI.h>
+#include <wchar.h>
+#include <stddef.h>
 
 typedef struct VkInstance_T*        VkInstance;
 typedef struct VkPhysicalDevice_T*  VkPhysicalDevice;
@@ -603,8 +1559,264 @@ typedef VkResult    (__stdcall * PFN_vkCreateDevice)                        (VkP
 typedef VkResult    (__stdcall * PFN_vkAllocateMemory)                      (VkDevice, const VkMemoryAllocateInfo*, const struct VkAllocationCallbacks*, VkDeviceMemory*);
 typedef VkResult    (__stdcall * PFN_vkMapMemory)                           (VkDevice, VkDeviceMemory, u64, u64, flags32, void**);
 
+static void* AllocateCodeMemory(umm Size)
+{
+    void* Result = VirtualAlloc(0, Size, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+    return(Result);
+}
+
+static void ProtectCodeMemory(void* Memory, umm Size)
+{
+    DWORD OldProtect;
+    VirtualProtect(Memory, Size, PAGE_EXECUTE_READ, &OldProtect);
+    FlushInstructionCache(GetCurrentProcess(), Memory, Size);
+}
+
 #define LoadFunctionPointer(loader, handle, name) PFN_##name name = (PFN_##name)loader(handle, #name)
 
+// Energy Meter Interface (emi.h), exposes the RAPL domains as channels of energy meter devices
+static const GUID EnergyMeterInterfaceGUID = { 0x45BD8344, 0x7ED6, 0x49CF, { 0xA4, 0x40, 0xC2, 0x76, 0xC9, 0x33, 0xB0, 0x53 } };
+
+#define IOCTL_EMI_GET_VERSION           0x224000
+#define IOCTL_EMI_GET_METADATA_SIZE     0x224004
+#define IOCTL_EMI_GET_METADATA          0x224008
+#define IOCTL_EMI_GET_MEASUREMENT       0x22400C
+
+#define EMI_VERSION_V2                  2
+#define EMI_NAME_MAX                    16
+#define EMI_PICOWATT_HOURS_TO_JOULES    3.6e-9
+
+typedef struct EMI_CHANNEL_V2
+{
+    u32     MeasurementUnit;    // Picowatt-hours is the only unit
+    u16     ChannelNameSize;    // Bytes
+    wchar_t ChannelName[1];
+} EMI_CHANNEL_V2;
+
+typedef struct EMI_METADATA_V2
+{
+    wchar_t         HardwareOEM[EMI_NAME_MAX];
+    wchar_t         HardwareModel[EMI_NAME_MAX];
+    u16             HardwareRevision;
+    u16             ChannelCount;
+    EMI_CHANNEL_V2  Channels[1];
+} EMI_METADATA_V2;
+
+typedef struct EMI_CHANNEL_MEASUREMENT_DATA
+{
+    u64 AbsoluteEnergy;
+    u64 AbsoluteTime;
+} EMI_CHANNEL_MEASUREMENT_DATA;
+
+#define MaxEnergyMeterCount         8
+#define MaxEnergyMeterChannelCount  16 // Also sizes the measurement buffer, meters with more channels are skipped
+
+typedef struct energy_meter
+{
+    HANDLE  Device;
+    u32     ChannelCount;
+    u32     PackageChannelMask; // One bit per channel, a meter can report several packages
+    u32     DRAMChannelMask;
+} energy_meter;
+
+static energy_meter EnergyMeters[MaxEnergyMeterCount];
+static u32 EnergyMeterCount;
+
+typedef enum energy_source
+{
+    EnergySource_None,
+    EnergySource_EMI,
+    EnergySource_MSR,
+} energy_source;
+
+// DRAM always comes from the EMI meters, the package domain may come from the MSR fallback instead
+static energy_source PackageEnergySource;
+
+// MSRs can't be read from user mode on Windows, so the fallback goes through the WinRing0 driver
+typedef BOOL        (__stdcall * PFN_InitializeOls)                         (void);
+typedef BOOL        (__stdcall * PFN_Rdmsr)                                 (DWORD, PDWORD, PDWORD);
+
+static PFN_Rdmsr Rdmsr;
+static u32 PackageMSR;
+static u32 LastPackageCount;
+static f64 PackageJoulesPerCount;
+static f64 PackageJoules;
+
+static b32 ReadMSR(u32 Index, u64* Value)
+{
+    b32 Result = 0;
+    DWORD Low, High;
+    if (Rdmsr && Rdmsr(Index, &Low, &High))
+    {
+        *Value = ((u64)High << 32) | Low;
+        Result = 1;
+    }
+    return(Result);
+}
+
+static void OpenEnergyMeter(const wchar_t* Path, energy_counters* Counters)
+{
+    HANDLE Device = CreateFileW(Path, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (Device != INVALID_HANDLE_VALUE)
+    {
+        energy_meter Meter = { Device, 0, 0, 0 };
+
+        DWORD BytesReturned = 0;
+        u16 Version = 0;
+        u32 MetadataSize = 0;
+        u8 Metadata[4096];
+        if (DeviceIoControl(Device, IOCTL_EMI_GET_VERSION, 0, 0, &Version, sizeof(Version), &BytesReturned, 0) &&
+            Version == EMI_VERSION_V2 &&
+            DeviceIoControl(Device, IOCTL_EMI_GET_METADATA_SIZE, 0, 0, &MetadataSize, sizeof(MetadataSize), &BytesReturned, 0) &&
+            MetadataSize <= sizeof(Metadata) &&
+            DeviceIoControl(Device, IOCTL_EMI_GET_METADATA, 0, 0, Metadata, MetadataSize, &BytesReturned, 0))
+        {
+            EMI_METADATA_V2* Header = (EMI_METADATA_V2*)Metadata;
+            EMI_CHANNEL_V2* Channel = Header->Channels;
+            if (Header->ChannelCount > MaxEnergyMeterChannelCount)
+            {
+                fprintf(stderr, "Skipping energy meter with %u channels (max %u)\n",
+                        (u32)Header->ChannelCount, MaxEnergyMeterChannelCount);
+            }
+            else
+            {
+                Meter.ChannelCount = Header->ChannelCount;
+            }
+
+            for (u32 ChannelIndex = 0; ChannelIndex < Meter.ChannelCount; ChannelIndex++)
+            {
+                // Channel names look like RAPL_Package0_PKG, RAPL_Package0_DRAM, etc.
+                wchar_t Name[64] = {0};
+                memcpy(Name, Channel->ChannelName, Min(Channel->ChannelNameSize, sizeof(Name) - sizeof(wchar_t)));
+                if (wcsstr(Name, L"_PKG"))
+                {
+                    Meter.PackageChannelMask |= 1u << ChannelIndex;
+                }
+                else if (wcsstr(Name, L"_DRAM"))
+                {
+                    Meter.DRAMChannelMask |= 1u << ChannelIndex;
+                }
+
+                Channel = (EMI_CHANNEL_V2*)((u8*)Channel + offsetof(EMI_CHANNEL_V2, ChannelName) + Channel->ChannelNameSize);
+            }
+        }
+
+        if ((Meter.PackageChannelMask || Meter.DRAMChannelMask) && EnergyMeterCount < MaxEnergyMeterCount)
+        {
+            EnergyMeters[EnergyMeterCount++] = Meter;
+            Counters->IsPresent |= (Meter.PackageChannelMask != 0);
+            Counters->HasDRAM |= (Meter.DRAMChannelMask != 0);
+        }
+        else
+        {
+            CloseHandle(Device);
+        }
+    }
+}
+
+static void InitializeEnergyCounters(energy_counters* Counters)
+{
+    HDEVINFO DeviceInfo = SetupDiGetClassDevsW(&EnergyMeterInterfaceGUID, 0, 0, DIGCF_PRESENT|DIGCF_DEVICEINTERFACE);
+    if (DeviceInfo != INVALID_HANDLE_VALUE)
+    {
+        SP_DEVICE_INTERFACE_DATA Interface = { sizeof(Interface) };
+        for (u32 InterfaceIndex = 0; SetupDiEnumDeviceInterfaces(DeviceInfo, 0, &EnergyMeterInterfaceGUID, InterfaceIndex, &Interface); InterfaceIndex++)
+        {
+            union
+            {
+                SP_DEVICE_INTERFACE_DETAIL_DATA_W Detail;
+                u8 Bytes[1024];
+            } Buffer;
+            Buffer.Detail.cbSize = sizeof(Buffer.Detail);
+            if (SetupDiGetDeviceInterfaceDetailW(DeviceInfo, &Interface, &Buffer.Detail, sizeof(Buffer), 0, 0))
+            {
+                OpenEnergyMeter(Buffer.Detail.DevicePath, Counters);
+            }
+        }
+        SetupDiDestroyDeviceInfoList(DeviceInfo);
+    }
+
+    if (Counters->IsPresent)
+    {
+        PackageEnergySource = EnergySource_EMI;
+    }
+
+    // Package domain only, the DRAM domain uses a model-specific energy unit that isn't reported by the MSRs
+#if MeasureEnergyWinRing0
+    if (!Counters->IsPresent)
+    {
+        HMODULE WinRing0DLL = LoadLibraryA("WinRing0x64.dll");
+        if (WinRing0DLL)
+        {
+            LoadFunctionPointer(GetProcAddress, WinRing0DLL, InitializeOls);
+            if (InitializeOls && InitializeOls())
+            {
+                Rdmsr = (PFN_Rdmsr)GetProcAddress(WinRing0DLL, "Rdmsr");
+
+                int CPUInfo[4];
+                __cpuid(CPUInfo, 0);
+                b32 IsAMD = (CPUInfo[1] == 0x68747541); // "Auth"
+
+                // Intel: MSR_RAPL_POWER_UNIT, MSR_PKG_ENERGY_STATUS
+                // AMD: Core::X86::Msr::RAPL_PWR_UNIT, PKG_ENERGY_STAT
+                u32 UnitMSR = IsAMD ? 0xC0010299 : 0x606;
+                PackageMSR  = IsAMD ? 0xC001029B : 0x611;
+
+                u64 Units = 0;
+                u64 Value = 0;
+                if (ReadMSR(UnitMSR, &Units) && ReadMSR(PackageMSR, &Value))
+                {
+                    // Energy status units are in bits 12:8 as a power of 1/2 J
+                    PackageJoulesPerCount = 1.0 / (f64)(1llu << ((Units >> 8) & 0x1F));
+                    LastPackageCount = (u32)Value;
+                    PackageEnergySource = EnergySource_MSR;
+                    Counters->IsPresent = 1;
+                }
+            }
+        }
+    }
+#endif
+}
+
+static energy_sample SampleEnergy(void)
+{
+    energy_sample Result = {0};
+    for (u32 MeterIndex = 0; MeterIndex < EnergyMeterCount; MeterIndex++)
+    {
+        energy_meter* Meter = EnergyMeters + MeterIndex;
+        EMI_CHANNEL_MEASUREMENT_DATA Data[MaxEnergyMeterChannelCount];
+        DWORD BytesReturned = 0;
+        if (DeviceIoControl(Meter->Device, IOCTL_EMI_GET_MEASUREMENT, 0, 0, Data, Meter->ChannelCount * sizeof(*Data), &BytesReturned, 0))
+        {
+            for (u32 ChannelIndex = 0; ChannelIndex < Meter->ChannelCount; ChannelIndex++)
+            {
+                f64 Joules = Data[ChannelIndex].AbsoluteEnergy * EMI_PICOWATT_HOURS_TO_JOULES;
+                if (Meter->PackageChannelMask & (1u << ChannelIndex))
+                {
+                    Result.Package += Joules;
+                }
+                else if (Meter->DRAMChannelMask & (1u << ChannelIndex))
+                {
+                    Result.DRAM += Joules;
+                }
+            }
+        }
+    }
+
+    if (PackageEnergySource == EnergySource_MSR)
+    {
+        // The MSR is a 32-bit wrapping counter, accumulate the deltas
+        u64 Value = 0;
+        if (ReadMSR(PackageMSR, &Value))
+        {
+            PackageJoules += (u32)((u32)Value - LastPackageCount) * PackageJoulesPerCount;
+            LastPackageCount = (u32)Value;
+        }
+        Result.Package = PackageJoules;
+    }
+    return(Result);
+}
+
 static test_context Initialize(void)
 {
     test_context Context = {0};
@@ -632,6 +1844,14 @@ static test_context Initialize(void)
         Context.TSCFrequencyEstimate = End - Begin;
     }
 
+#if UseSimulatedBAR
+    Context.BufferSize = 64llu << 20;
+    Context.Buffers[MemoryType_BAR] = VirtualAlloc(0, Context.BufferSize, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+    Context.IsBARSimulated = 1;
+    SimBARInitialize(&Context.SimBAR, SimBARConfig, Context.TSCFrequencyEstimate);
+    snprintf(Context.DeviceName, sizeof(Context.DeviceName), "Simulated BAR (%.1f GB/s link, %u WC buffers, %.0f ns latency)",
+             SimBARConfig.LinkBandwidth / (1000.0 * 1000.0 * 1000.0), SimBARConfig.BufferCount, SimBARConfig.PostedWriteLatency * (1000.0 * 1000.0 * 1000.0));
+#else
     HMODULE VulkanDLL = LoadLibraryA("vulkan-1.dll");
     if (VulkanDLL)
     {
@@ -750,7 +1970,14 @@ static test_context Initialize(void)
             }
         }
     }
+#endif
 
     Context.Buffers[MemoryType_Host] = VirtualAlloc(0, Context.BufferSize, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+    Context.ScratchSize = Context.BufferSize;
+    Context.Scratch = VirtualAlloc(0, Context.ScratchSize, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+
+#if MeasureEnergy
+    InitializeEnergyCounters(&Context.Energy);
+#endif
     return(Context);
 }
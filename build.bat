@@ -6,4 +6,4 @@ IF NOT EXIST bin (
 cl -nologo -O2 -Oi -c barbandwidth.c -Fo:"bin/"
 nasm -f win64 write.asm -o "bin/write.obj"
 
-link /NOLOGO bin/write.obj bin/barbandwidth.obj /OUT:"bin/bbw.exe"
\ No newline at end of file
+link /NOLOGO bin/write.obj bin/barbandwidth.obj setupapi.lib /OUT:"bin/bbw.exe"
\ No newline at end of file
@@ -4,6 +4,19 @@ global Write32x4
 global WriteNonTemporal32x4
 global Copy32x4
 global CopyNonTemporal32x4
+global CopyGatherNonTemporal32x4
+global WriteSparse8
+global WriteSparse16
+global WriteSparse32
+global WriteSparse64
+global WriteSparse128
+global WriteSparse256
+global CopySparse8
+global CopySparse16
+global CopySparse32
+global CopySparse64
+global CopySparse128
+global CopySparse256
 
 section .text
 
@@ -86,4 +99,131 @@ CopyNonTemporal32x4:
     add r8, 128
     sub rcx, 128
     jnz .loop
-    ret
\ No newline at end of file
+    ret
+
+; rcx: fragment count, rdx: destination (32-byte aligned), r8: copy_fragment list
+; Fragments are written back-to-back, their sizes must be multiples of 16.
+; A fragment that leaves the destination 16 bytes off is followed by a single
+; xmm store so that the ymm streaming stores stay aligned.
+CopyGatherNonTemporal32x4:
+.fragment:
+    mov r9, [r8]
+    mov r10, [r8 + 8]
+    add r8, 16
+    test r10, r10
+    jz .next
+    test rdx, 16
+    jz .aligned
+    vmovdqu xmm0, [r9]
+    vmovntdq [rdx], xmm0
+    add rdx, 16
+    add r9, 16
+    sub r10, 16
+.aligned:
+    sub r10, 128
+    jae .loop
+    jmp .tail
+    align 64
+.loop:
+    vmovdqu ymm0, [r9]
+    vmovntdq [rdx], ymm0
+    vmovdqu ymm0, [r9 + 32]
+    vmovntdq [rdx + 32], ymm0
+    vmovdqu ymm0, [r9 + 64]
+    vmovntdq [rdx + 64], ymm0
+    vmovdqu ymm0, [r9 + 96]
+    vmovntdq [rdx + 96], ymm0
+    add rdx, 128
+    add r9, 128
+    sub r10, 128
+    jae .loop
+.tail:
+    add r10, 128
+    cmp r10, 32
+    jb .tail16
+.tail_loop:
+    vmovdqu ymm0, [r9]
+    vmovntdq [rdx], ymm0
+    add rdx, 32
+    add r9, 32
+    sub r10, 32
+    cmp r10, 32
+    jae .tail_loop
+.tail16:
+    test r10, r10
+    jz .next
+    vmovdqu xmm0, [r9]
+    vmovntdq [rdx], xmm0
+    add rdx, 16
+.next:
+    sub rcx, 1
+    jnz .fragment
+    ret
+
+; rcx: patch count, rdx: destination base, r8: sparse_patches
+%macro WriteSparse 1
+WriteSparse%1:
+    mov r8, [r8 + 8]
+    vxorps ymm0, ymm0
+    align 64
+.loop:
+    mov eax, [r8]
+%if %1 == 8
+    vmovq [rdx + rax], xmm0
+%elif %1 == 16
+    vmovups [rdx + rax], xmm0
+%else
+%assign Offset 0
+%rep %1 / 32
+    vmovups [rdx + rax + Offset], ymm0
+%assign Offset Offset + 32
+%endrep
+%endif
+    add r8, 4
+    sub rcx, 1
+    jnz .loop
+    ret
+%endmacro
+
+; rcx: patch count, rdx: destination base, r8: sparse_patches
+; Each patch is read from the same offset in the source as it's written to in the destination
+%macro CopySparse 1
+CopySparse%1:
+    mov r9, [r8]
+    mov r8, [r8 + 8]
+    align 64
+.loop:
+    mov eax, [r8]
+%if %1 == 8
+    vmovq xmm0, [r9 + rax]
+    vmovq [rdx + rax], xmm0
+%elif %1 == 16
+    vmovups xmm0, [r9 + rax]
+    vmovups [rdx + rax], xmm0
+%else
+%assign Offset 0
+%rep %1 / 32
+    vmovups ymm0, [r9 + rax + Offset]
+    vmovups [rdx + rax + Offset], ymm0
+%assign Offset Offset + 32
+%endrep
+%endif
+    add r8, 4
+    sub rcx, 1
+    jnz .loop
+    ret
+%endmacro
+
+WriteSparse 8
+WriteSparse 16
+WriteSparse 32
+WriteSparse 64
+WriteSparse 128
+WriteSparse 256
+
+CopySparse 8
+CopySparse 16
+CopySparse 32
+CopySparse 64
+CopySparse 128
+CopySparse 256